@@ -0,0 +1,126 @@
+/**
+Purpose: host benchmarks of mrm-ref-can, 8 simulated boards. Run with "make bench".
+Wall-clock time of the host, useful for comparison between variants, not as absolute ESP32 figures.
+*/
+#include "sim-board.h"
+#include <chrono>
+
+static double nsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+/** Decode cost of a readings set for 8 boards, with each filter
+*/
+static void benchFilter() {
+	const uint32_t rounds = 200000;
+	const char* names[] = {"none", "EMA", "median", "median + EMA"};
+	double noneNs = 0;
+	printf("Filter, decode of a readings set (3 frames), 8 boards:\n");
+	for (uint8_t type = Mrm_ref_can::FILTER_NONE; type <= Mrm_ref_can::FILTER_MEDIAN_AND_EMA; type++) {
+		Mrm_ref_can refCan(8);
+		RefCanSimulator simulator(refCan, 8);
+		refCan.filterSet((Mrm_ref_can::FilterType)type, 2);
+		double ns = 1e12;
+		for (uint8_t repetition = 0; repetition < 5; repetition++) { // Best of 5, less noise
+			auto start = std::chrono::steady_clock::now();
+			for (uint32_t round = 0; round < rounds; round++)
+				for (uint8_t device = 0; device < 8; device++) {
+					simulator.valuesSet(device, (round * 37 + device) & 0x0FFF);
+					simulator.setSend(device);
+				}
+			ns = std::min(ns, nsSince(start) / rounds);
+		}
+		if (type == Mrm_ref_can::FILTER_NONE)
+			noneNs = ns;
+		printf("  %-13s %7.1f ns per 8 sets, filter %6.1f ns per set\n", names[type], ns, (ns - noneNs) / 8);
+	}
+}
+
+/** Cost of reading() with latency recording off and on, and latencies of a simulated control loop
+*/
+static void benchLatency() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 8);
+	for (uint8_t device = 0; device < 8; device++)
+		simulator.setSend(device);
+	const uint32_t reads = 2000000;
+	volatile uint32_t sum = 0;
+	printf("Latency recording, reading() cost:\n");
+	for (bool enabled : {false, true}) {
+		refCan.latencyEnable(enabled);
+		auto start = std::chrono::steady_clock::now();
+		for (uint32_t i = 0; i < reads; i++)
+			sum += refCan.reading(i % MRM_REF_CAN_SENSOR_COUNT, (i / MRM_REF_CAN_SENSOR_COUNT) % 8);
+		printf("  %-8s %5.1f ns per call\n", enabled ? "enabled" : "disabled", nsSince(start) / reads);
+	}
+
+	// Boards refresh each 10 ms, in simulated time. Control loop reads all 8 each 7 ms.
+	Mrm_ref_can loopRefCan(8);
+	RefCanSimulator loopSimulator(loopRefCan, 8);
+	uint16_t values[MRM_REF_CAN_SENSOR_COUNT];
+	for (uint8_t device = 0; device < 8; device++)
+		loopRefCan.readings(values, device); // Start the boards.
+	loopRefCan.latencyEnable();
+	loopRefCan.latencyClear();
+	for (uint16_t cycle = 0; cycle < 10000; cycle++) {
+		sim::advanceMs(7);
+		for (uint8_t device = 0; device < 8; device++)
+			loopRefCan.readings(values, device);
+	}
+	printf("Simulated loop, 10 ms refresh, 7 ms loop, board 0, us, below:\n");
+	for (uint8_t percent : {50, 90, 99})
+		printf("  p%-3i first read %6u, age %6u\n", percent, loopRefCan.latencyPercentile(percent, true), loopRefCan.latencyPercentile(percent, false));
+}
+
+/** A line of readings of 8 boards: a print() per value, as before, against buffered readingsPrint() and test()
+*/
+static void benchPrint() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 8);
+	uint16_t values[MRM_REF_CAN_SENSOR_COUNT];
+	for (uint8_t device = 0; device < 8; device++) {
+		simulator.valuesSet(device, 1000 + device);
+		refCan.readings(values, device); // Start the board, it will keep sending.
+	}
+	const uint32_t lines = 20000;
+	printf("Print a line of analog readings, 8 boards:\n");
+
+	sim::printCalls = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (uint32_t line = 0; line < lines; line++) {
+		sim::printed.clear();
+		refCan.print("Refl:");
+		for (uint8_t device = 0; device < 8; device++)
+			for (uint8_t i = 0; i < MRM_REF_CAN_SENSOR_COUNT; i++)
+				refCan.print("%3i ", refCan.reading(i, device));
+	}
+	printf("  print() per value   %7.1f ns per line, %3u print() calls\n", nsSince(start) / lines, sim::printCalls / lines);
+
+	sim::printCalls = 0;
+	start = std::chrono::steady_clock::now();
+	for (uint32_t line = 0; line < lines; line++) {
+		sim::printed.clear();
+		refCan.readingsPrint();
+	}
+	printf("  readingsPrint()     %7.1f ns per line, %3u print() calls\n", nsSince(start) / lines, sim::printCalls / lines);
+
+	// test() prints once each 300 ms, so simulated time is advanced between lines, outside of measurement.
+	sim::printCalls = 0;
+	double ns = 0;
+	for (uint32_t line = 0; line < lines; line++) {
+		sim::printed.clear();
+		sim::advanceMs(301);
+		start = std::chrono::steady_clock::now();
+		refCan.test(true);
+		ns += nsSince(start);
+	}
+	printf("  test(true)          %7.1f ns per line, %3u print() calls\n", ns / lines, sim::printCalls / lines);
+	printf("  test(true) line: %s", sim::printed.c_str());
+}
+
+int main() {
+	benchFilter();
+	benchLatency();
+	benchPrint();
+	return 0;
+}
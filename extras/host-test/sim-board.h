@@ -0,0 +1,107 @@
+#pragma once
+/**
+Purpose: simulated mrm-ref-can boards on the host CAN Bus, for extras/host-test only.
+A powered and started board sends a readings set each refresh period of simulated time. A killed board is silent and, when revived, waits for a new start command.
+*/
+#include "mrm-ref-can.h"
+
+class RefCanSimulator {
+	struct Board {
+		bool powered = true;
+		bool started = false;
+		uint8_t mode = 0; // As in start(): 0 analog, 1 digital with dark center, 2 digital with bright center.
+		uint16_t refreshMs = 10;
+		uint32_t lastSentMs = 0;
+		uint16_t value[MRM_REF_CAN_SENSOR_COUNT] = {};
+	};
+	Mrm_ref_can& refCan;
+	std::vector<Board> boards;
+
+public:
+	RefCanSimulator(Mrm_ref_can& refCan, uint8_t boardCount) : refCan(refCan), boards(boardCount) {
+		for (uint8_t i = 0; i < boardCount; i++)
+			refCan.add((char*)"RefCan");
+		sim::starts.clear();
+		sim::onStart = [this](uint8_t deviceNumber, uint8_t mode) {
+			if (deviceNumber < boards.size() && boards[deviceNumber].powered) {
+				boards[deviceNumber].started = true;
+				boards[deviceNumber].mode = mode;
+			}
+		};
+		sim::onTick = [this]() { tick(); };
+	}
+
+	~RefCanSimulator() {
+		sim::onStart = nullptr;
+		sim::onTick = nullptr;
+	}
+
+	/** Power off a board: it stops sending and forgets it was started.
+	*/
+	void kill(uint8_t deviceNumber) {
+		boards[deviceNumber].powered = false;
+		boards[deviceNumber].started = false;
+	}
+
+	/** Power on a board. It sends nothing till started again.
+	*/
+	void revive(uint8_t deviceNumber) { boards[deviceNumber].powered = true; }
+
+	void refreshSet(uint8_t deviceNumber, uint16_t ms) { boards[deviceNumber].refreshMs = ms; }
+
+	/** Values of the next readings sets
+	*/
+	void valuesSet(uint8_t deviceNumber, uint16_t value) {
+		for (uint16_t& v : boards[deviceNumber].value)
+			v = value;
+	}
+
+	/** Send a single CAN Bus frame from a board
+	*/
+	void frameSend(uint8_t deviceNumber, uint8_t command, const uint8_t* payload, uint8_t length) {
+		CANMessage message = {};
+		message.id = CAN_ID_REF_CAN0_IN + 2 * deviceNumber;
+		message.dlc = length + 1;
+		message.data[0] = command;
+		memcpy(message.data + 1, payload, length);
+		refCan.messageDecode(message);
+	}
+
+	/** Send a complete analog readings set, 3 frames, regardless of board's state
+	*/
+	void setSend(uint8_t deviceNumber) {
+		static const uint8_t commands[3] = {COMMAND_REF_CAN_SENDING_SENSORS_1_TO_3, COMMAND_REF_CAN_SENDING_SENSORS_4_TO_6, COMMAND_REF_CAN_SENDING_SENSORS_7_TO_9};
+		for (uint8_t frame = 0; frame < 3; frame++) {
+			uint8_t payload[6];
+			for (uint8_t i = 0; i < 3; i++) {
+				payload[2 * i] = boards[deviceNumber].value[3 * frame + i] >> 8;
+				payload[2 * i + 1] = boards[deviceNumber].value[3 * frame + i] & 0xFF;
+			}
+			frameSend(deviceNumber, commands[frame], payload, 6);
+		}
+	}
+
+	/** Send digital readings and center, regardless of board's state
+	@param darkBits - bit i: transistor i is 1
+	*/
+	void centerSend(uint8_t deviceNumber, uint16_t center, uint16_t darkBits) {
+		uint8_t payload[4] = {(uint8_t)(center & 0xFF), (uint8_t)(center >> 8), 0, (uint8_t)((darkBits >> 8) & 1)}; // Transistor 1 in the most significant bit
+		for (uint8_t i = 0; i < 8; i++)
+			if (darkBits & (1 << i))
+				payload[2] |= 0x80 >> i;
+		frameSend(deviceNumber, COMMAND_REF_CAN_SENDING_SENSORS_CENTER, payload, 4);
+	}
+
+	void tick() {
+		for (uint8_t i = 0; i < boards.size(); i++) {
+			Board& board = boards[i];
+			if (!board.powered || !board.started || millis() - board.lastSentMs < board.refreshMs)
+				continue;
+			board.lastSentMs = millis();
+			if (board.mode == 0)
+				setSend(i);
+			else
+				centerSend(i, 5000, 0);
+		}
+	}
+};
@@ -0,0 +1,36 @@
+#pragma once
+/**
+Purpose: host stand-in for Arduino core, for extras/host-test only.
+Time is simulated: it advances only with delay() and sim::advanceMs(), so tests are deterministic.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sim {
+	inline uint64_t nowUs = 1000000; // Starts at 1 s, so that lastReadingsMs == 0 still means "no readings".
+	inline std::function<void()> onTick; // Called each simulated millisecond, for example to send CAN Bus frames.
+
+	/** Advance simulated time
+	@param us - microseconds
+	*/
+	inline void advanceUs(uint64_t us) {
+		while (us > 0) {
+			uint64_t step = std::min<uint64_t>(us, 1000 - nowUs % 1000);
+			nowUs += step;
+			us -= step;
+			if (nowUs % 1000 == 0 && onTick)
+				onTick();
+		}
+	}
+
+	inline void advanceMs(uint32_t ms) { advanceUs((uint64_t)ms * 1000); }
+}
+
+inline uint32_t millis() { return (uint32_t)(sim::nowUs / 1000); }
+inline uint32_t micros() { return (uint32_t)sim::nowUs; }
+inline void delay(uint32_t ms) { sim::advanceMs(ms); }
@@ -0,0 +1,91 @@
+#pragma once
+/**
+Purpose: host stand-in for mrm-board, for extras/host-test only. Only the part of SensorBoard used by mrm-ref-can.
+start() and print() are recorded so that tests can check them.
+*/
+#include "Arduino.h"
+#include <stdarg.h>
+
+#define ID_MRM_REF_CAN 0x10
+#define ERROR_COMMAND_UNKNOWN 1
+
+struct CANMessage {
+	uint32_t id;
+	uint8_t dlc;
+	uint8_t data[8];
+};
+
+struct Device {
+	std::string name;
+	uint8_t number;
+	bool alive;
+	uint32_t lastReadingsMs;
+	uint16_t canIdIn;
+	uint16_t canIdOut;
+};
+
+namespace sim {
+	struct Start {
+		uint32_t ms;
+		uint8_t deviceNumber;
+		uint8_t mode;
+	};
+	inline std::vector<Start> starts; // All start() calls.
+	inline std::function<void(uint8_t deviceNumber, uint8_t mode)> onStart; // Simulated board receives start command.
+	inline uint32_t printCalls = 0;
+	inline size_t printLongest = 0; // Longest single print() output.
+	inline std::string printed; // All print() output.
+	inline bool printEcho = false; // Also write print() output to stdout.
+}
+
+class SensorBoard {
+protected:
+	std::vector<Device> devices;
+	uint8_t nextFree = 0;
+	uint8_t maximumNumberOfBoards;
+	uint8_t measuringModeLimit = 0;
+	std::string _boardsName;
+	uint8_t canData[8];
+
+public:
+	char errorMessage[60] = "";
+
+	SensorBoard(uint8_t, const char* boardsName, uint8_t maxNumberOfBoards, int, int) :
+		maximumNumberOfBoards(maxNumberOfBoards), _boardsName(boardsName) {}
+
+	void add(char* deviceName, uint16_t canIn, uint16_t canOut) {
+		devices.push_back(Device{deviceName, nextFree, true, 0, canIn, canOut});
+		nextFree++;
+	}
+
+	bool aliveWithOptionalScan(Device* device, bool = false) { return device->alive; }
+	void aliveSet(bool yes, Device* device) { device->alive = yes; }
+	void delayMs(uint32_t ms) { sim::advanceMs(ms); }
+	void end() {}
+	bool isForMe(uint32_t id, Device& device) { return id == device.canIdIn; }
+	bool messageDecodeCommon(CANMessage&, Device&) { return false; }
+	void errorAdd(CANMessage&, int, bool, bool) {}
+	void messageSend(uint8_t*, uint8_t, uint8_t) {}
+	std::string name() { return _boardsName; }
+	void noLoopWithoutThis() { sim::advanceMs(1); }
+	bool setup() { return false; }
+
+	void start(Device* device, uint8_t measuringMode) {
+		sim::starts.push_back({millis(), device->number, measuringMode});
+		if (sim::onStart)
+			sim::onStart(device->number, measuringMode);
+	}
+
+	void print(const char* fmt, ...) {
+		char buffer[2048];
+		va_list argp;
+		va_start(argp, fmt);
+		int length = vsnprintf(buffer, sizeof(buffer), fmt, argp);
+		va_end(argp);
+		sim::printCalls++;
+		sim::printLongest = std::max(sim::printLongest, (size_t)length);
+		sim::printed += buffer;
+		if (sim::printEcho)
+			fputs(buffer, stdout);
+	}
+};
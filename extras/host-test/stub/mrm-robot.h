@@ -0,0 +1,2 @@
+#pragma once
+// Host stand-in for mrm-robot, for extras/host-test only. Nothing from it is needed.
@@ -0,0 +1,291 @@
+/**
+Purpose: host tests of mrm-ref-can, with simulated boards and time. Run with "make test".
+*/
+#include "sim-board.h"
+#include <thread>
+
+static int failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { printf("%s:%i: failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+#define CHECK_EQUAL(expected, actual) do { long long e = (expected), a = (actual); if (e != a) { printf("%s:%i: failed: %s == %s, %lli != %lli\n", __FILE__, __LINE__, #expected, #actual, e, a); failures++; } } while (0)
+
+/** Median of 3 rejects a single spike, then the average converges
+*/
+static void testFilterMedianAndEma() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 1);
+	refCan.filterSet(Mrm_ref_can::FILTER_MEDIAN_AND_EMA, 1);
+	const uint16_t input[] = {100, 100, 1000, 100, 200, 200, 200, 200};
+	const uint16_t expected[] = {100, 100, 100, 100, 150, 175, 188, 194};
+	for (uint8_t i = 0; i < sizeof(input) / sizeof(input[0]); i++) {
+		simulator.valuesSet(0, input[i]);
+		simulator.setSend(0);
+		CHECK_EQUAL(expected[i], refCan.reading(4));
+		CHECK_EQUAL(input[i], refCan.readingRaw(4));
+	}
+}
+
+/** Without filter, filtered view equals raw
+*/
+static void testFilterNone() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 1);
+	simulator.valuesSet(0, 321);
+	simulator.setSend(0);
+	uint16_t values[MRM_REF_CAN_SENSOR_COUNT];
+	CHECK(refCan.readings(values));
+	for (uint16_t value : values)
+		CHECK_EQUAL(321, value);
+}
+
+/** A slow consumer still gets extremes of all the frames since its last poll
+*/
+static void testPeakHold() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 1);
+	uint16_t maximum[MRM_REF_CAN_SENSOR_COUNT], minimum[MRM_REF_CAN_SENSOR_COUNT], darkSeen;
+	CHECK(!refCan.peakHoldReadAndClear(maximum, minimum, &darkSeen));
+	CHECK_EQUAL(0, maximum[0]);
+	CHECK_EQUAL(0xFFFF, minimum[0]);
+
+	for (uint16_t value : {300, 900, 50, 400}) {
+		simulator.valuesSet(0, value);
+		simulator.setSend(0);
+	}
+	CHECK(refCan.peakHoldReadAndClear(maximum, minimum, &darkSeen));
+	CHECK_EQUAL(900, maximum[8]);
+	CHECK_EQUAL(50, minimum[8]);
+	CHECK_EQUAL(0, darkSeen); // No calibration data, so nothing is below its middle.
+	CHECK(!refCan.peakHoldReadAndClear(maximum, minimum, &darkSeen));
+
+	simulator.centerSend(0, 3000, 0b000000100); // Digital with bright center: 0 is dark
+	CHECK(refCan.peakHoldReadAndClear(NULL, NULL, &darkSeen));
+	CHECK_EQUAL(0b111111011, darkSeen);
+}
+
+/** Switching a streaming board from analog to digital with dark center: its first digital frames must not be read as in the old mode
+*/
+static void testPeakHoldModeSwitch() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 1);
+	uint16_t values[MRM_REF_CAN_SENSOR_COUNT], darkSeen;
+	CHECK(refCan.readings(values)); // Analog started
+	sim::advanceMs(50);
+	refCan.peakHoldReadAndClear(NULL, NULL, NULL);
+	CHECK_EQUAL(5000, refCan.center(0, true)); // Digital with dark center, the board reports no dark transistor.
+	CHECK(!refCan.dark(0));
+	refCan.peakHoldReadAndClear(NULL, NULL, &darkSeen);
+	CHECK_EQUAL(0, darkSeen);
+}
+
+/** Decode and poll on different threads: each transistor's maximum and minimum always come as a pair, none is lost
+*/
+static void testPeakHoldConcurrent() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 1);
+	const uint16_t sets = 20000;
+	std::atomic<bool> done(false);
+	std::thread decoder([&]() {
+		for (uint16_t i = 1; i <= sets; i++) {
+			simulator.valuesSet(0, i % 2 ? 20000 + i / 2 : 20000 - i / 2); // Extremes spread over all the sets
+			simulator.setSend(0);
+		}
+		done = true;
+	});
+	uint16_t maximum[MRM_REF_CAN_SENSOR_COUNT], minimum[MRM_REF_CAN_SENSOR_COUNT];
+	uint16_t overallMaximum = 0, overallMinimum = 0xFFFF;
+	bool consistent = true;
+	for (bool last = false; !last; ) {
+		last = done;
+		if (refCan.peakHoldReadAndClear(maximum, minimum))
+			for (uint8_t i = 0; i < MRM_REF_CAN_SENSOR_COUNT; i++) {
+				consistent = consistent && (minimum[i] <= maximum[i] || (maximum[i] == 0 && minimum[i] == 0xFFFF)); // Pair or cleared
+				overallMaximum = std::max(overallMaximum, maximum[i]);
+				overallMinimum = std::min(overallMinimum, minimum[i]);
+			}
+	}
+	decoder.join();
+	CHECK(consistent);
+	CHECK_EQUAL(20000 + (sets - 1) / 2, overallMaximum);
+	CHECK_EQUAL(20000 - sets / 2, overallMinimum);
+}
+
+/** any() and dark() agree in both digital modes. The simulated board reports all bits 0: dark in bright-center mode, bright in dark-center mode.
+*/
+static void testAnyDigitalModes() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 1);
+	CHECK_EQUAL(5000, refCan.center(0, false)); // Digital with bright center
+	CHECK(refCan.dark(0));
+	CHECK(refCan.any(true));
+	CHECK(!refCan.any(false));
+
+	CHECK_EQUAL(5000, refCan.center(0, true)); // Digital with dark center
+	CHECK(!refCan.dark(0));
+	CHECK(!refCan.any(true));
+	CHECK(refCan.any(false));
+}
+
+static std::vector<std::pair<uint32_t, uint8_t>> healthChanges; // millis() and new health
+
+static void healthChanged(uint8_t deviceNumber, uint8_t oldHealth, uint8_t newHealth) {
+	healthChanges.push_back({millis(), newHealth});
+}
+
+/** A board stops sending mid-stream: alive, suspect, dead, then restarted with exponential backoff, without blocking, till revived
+*/
+static void testHealthKillAndRevive() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 1);
+	healthChanges.clear();
+	refCan.healthNotificationSet(healthChanged);
+	simulator.valuesSet(0, 123);
+	CHECK_EQUAL(123, refCan.reading(0)); // The first call starts the board and waits for its readings.
+	for (uint16_t ms = 0; ms < 100; ms++) {
+		sim::advanceMs(1);
+		CHECK_EQUAL(123, refCan.reading(0));
+	}
+	CHECK_EQUAL(Mrm_ref_can::HEALTH_ALIVE, refCan.health());
+	CHECK(healthChanges.empty());
+
+	simulator.kill(0);
+	uint32_t killedMs = millis();
+	bool blocked = false, stale = false;
+	for (uint16_t ms = 0; ms < 20000; ms++) {
+		sim::advanceMs(1);
+		uint64_t beforeUs = sim::nowUs;
+		uint16_t value = refCan.reading(0);
+		refCan.healthCheck();
+		blocked = blocked || sim::nowUs != beforeUs;
+		stale = stale || (refCan.health() != Mrm_ref_can::HEALTH_ALIVE && value != 0);
+	}
+	CHECK(!blocked);
+	CHECK(!stale);
+
+	CHECK(healthChanges.size() >= 4);
+	CHECK_EQUAL(Mrm_ref_can::HEALTH_SUSPECT, healthChanges[0].second);
+	CHECK(healthChanges[0].first > killedMs + MRM_REF_CAN_SUSPECT_MS - 15 && healthChanges[0].first <= killedMs + MRM_REF_CAN_SUSPECT_MS);
+	CHECK_EQUAL(Mrm_ref_can::HEALTH_DEAD, healthChanges[1].second);
+	CHECK(healthChanges[1].first > killedMs + MRM_REF_CAN_SUSPECT_MS * MRM_REF_CAN_DEAD_PERIODS - 15 && healthChanges[1].first <= killedMs + MRM_REF_CAN_SUSPECT_MS * MRM_REF_CAN_DEAD_PERIODS);
+
+	// Dead and recovering alternate, dead lasting 100, 200, 400,... ms, at most MRM_REF_CAN_RETRY_MAX_MS.
+	uint32_t expectedBackoffMs = MRM_REF_CAN_RETRY_FIRST_MS;
+	uint8_t backoffs = 0;
+	for (size_t i = 1; i + 1 < healthChanges.size(); i += 2) {
+		CHECK_EQUAL(Mrm_ref_can::HEALTH_DEAD, healthChanges[i].second);
+		CHECK_EQUAL(Mrm_ref_can::HEALTH_RECOVERING, healthChanges[i + 1].second);
+		CHECK_EQUAL(expectedBackoffMs, healthChanges[i + 1].first - healthChanges[i].first);
+		expectedBackoffMs = std::min(expectedBackoffMs * 2, (uint32_t)MRM_REF_CAN_RETRY_MAX_MS);
+		backoffs++;
+	}
+	CHECK(backoffs >= 8); // Reached the limit and stayed there.
+	CHECK_EQUAL(MRM_REF_CAN_RETRY_MAX_MS, expectedBackoffMs);
+
+	simulator.revive(0);
+	simulator.valuesSet(0, 456);
+	bool revived = false;
+	for (uint16_t ms = 0; ms < MRM_REF_CAN_RETRY_MAX_MS + 1000 && !revived; ms++) {
+		sim::advanceMs(1);
+		refCan.healthCheck();
+		revived = refCan.reading(0) == 456;
+	}
+	CHECK(revived);
+	CHECK_EQUAL(Mrm_ref_can::HEALTH_ALIVE, healthChanges.back().second);
+	CHECK_EQUAL(Mrm_ref_can::HEALTH_RECOVERING, healthChanges[healthChanges.size() - 2].second);
+	refCan.healthNotificationSet(NULL);
+}
+
+/** A board dead from the start: only the first call waits for it
+*/
+static void testHealthDeadAtStart() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 1);
+	simulator.kill(0);
+	uint32_t startMs = millis();
+	CHECK_EQUAL(0, refCan.reading(0));
+	CHECK(millis() - startMs >= 8 * 50); // 8 tries of 50 ms
+	CHECK_EQUAL(Mrm_ref_can::HEALTH_DEAD, refCan.health());
+	startMs = millis();
+	for (uint16_t i = 0; i < 1000; i++) {
+		refCan.reading(0);
+		refCan.dark(0);
+		refCan.center();
+	}
+	CHECK_EQUAL(startMs, millis());
+}
+
+/** Percentiles of injected, known delays between a readings set and its reads
+*/
+static void testLatency() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 1);
+	simulator.setSend(0);
+	refCan.reading(0);
+	CHECK_EQUAL(0, refCan.latencyPercentile(50)); // Disabled: nothing recorded.
+
+	refCan.latencyEnable();
+	simulator.setSend(0);
+	refCan.reading(0); // Read at once, 0 us: must differ from "no data".
+	CHECK_EQUAL(1, refCan.latencyPercentile(100));
+	refCan.latencyClear();
+
+	for (uint8_t i = 0; i < 100; i++) {
+		simulator.setSend(0);
+		sim::advanceUs(i < 90 ? 300 : 5000);
+		refCan.reading(0);
+		sim::advanceUs(1000);
+		refCan.reading(1); // Same set, only age recorded
+	}
+	CHECK_EQUAL(512, refCan.latencyPercentile(50));
+	CHECK_EQUAL(512, refCan.latencyPercentile(90));
+	CHECK_EQUAL(8192, refCan.latencyPercentile(91));
+	CHECK_EQUAL(8192, refCan.latencyPercentile(100));
+	CHECK_EQUAL(512, refCan.latencyPercentile(45, false)); // 90 of 200 reads at 300 us
+	CHECK_EQUAL(2048, refCan.latencyPercentile(90, false)); // 1300 us
+	CHECK_EQUAL(8192, refCan.latencyPercentile(100, false)); // 6000 us
+
+	refCan.latencyClear();
+	CHECK_EQUAL(0, refCan.latencyPercentile(100));
+}
+
+/** A line of 8 boards' readings is formatted as before, but printed in a few chunks
+*/
+static void testReadingsPrint() {
+	Mrm_ref_can refCan(8);
+	RefCanSimulator simulator(refCan, 8);
+	std::string expected = "Refl:";
+	for (uint8_t device = 0; device < 8; device++) {
+		simulator.valuesSet(device, device == 7 ? 65535 : device * 11);
+		simulator.setSend(device);
+		for (uint8_t i = 0; i < MRM_REF_CAN_SENSOR_COUNT; i++) {
+			char text[10];
+			snprintf(text, sizeof(text), "%3i ", device == 7 ? 65535 : device * 11);
+			expected += text;
+		}
+	}
+	sim::printed.clear();
+	sim::printCalls = 0;
+	sim::printLongest = 0;
+	refCan.readingsPrint();
+	CHECK(sim::printed == expected);
+	CHECK(sim::printLongest <= MRM_REF_CAN_PRINT_CHUNK);
+	CHECK_EQUAL((expected.size() + MRM_REF_CAN_PRINT_CHUNK - 1) / MRM_REF_CAN_PRINT_CHUNK, sim::printCalls);
+}
+
+int main() {
+	testFilterMedianAndEma();
+	testFilterNone();
+	testPeakHold();
+	testPeakHoldModeSwitch();
+	testPeakHoldConcurrent();
+	testAnyDigitalModes();
+	testHealthKillAndRevive();
+	testHealthDeadAtStart();
+	testLatency();
+	testReadingsPrint();
+	if (failures)
+		printf("%i check(s) failed.\n", failures);
+	else
+		printf("All tests passed.\n");
+	return failures ? 1 : 0;
+}
@@ -3,6 +3,41 @@
 
 std::map<int, std::string>* Mrm_ref_can::commandNamesSpecific = NULL;
 
+/** Append text to a line buffer
+@param p - current end of text in the buffer
+@param end - last byte of the buffer, reserved for terminating 0
+@param text - text to append
+@return - new end of text
+*/
+static char* printAppend(char* p, char* end, const char* text) {
+	while (*text && p < end)
+		*p++ = *text++;
+	*p = 0;
+	return p;
+}
+
+/** Append an unsigned integer to a line buffer, like "%*u" but without printf's cost
+@param p - current end of text in the buffer
+@param end - last byte of the buffer, reserved for terminating 0
+@param value - number
+@param width - minimum width, padded with leading spaces
+@return - new end of text
+*/
+static char* printAppend(char* p, char* end, uint32_t value, uint8_t width = 0) {
+	char digits[10];
+	uint8_t count = 0;
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+	for (uint8_t i = count; i < width && p < end; i++)
+		*p++ = ' ';
+	while (count > 0 && p < end)
+		*p++ = digits[--count];
+	*p = 0;
+	return p;
+}
+
 /** Constructor
 @param robot - robot containing this board
 @param esp32CANBusSingleton - a single instance of CAN Bus common library for all CAN Bus peripherals.
@@ -21,6 +56,33 @@ Mrm_ref_can::Mrm_ref_can(uint8_t maxNumberOfBoards) :
 	_transistorCount = new std::vector<uint8_t>(maximumNumberOfBoards);
 	for (uint8_t i = 0; i < maximumNumberOfBoards; i++)
 		(*_transistorCount)[i] = 9;
+	_filter = new std::vector<uint8_t>(maxNumberOfBoards);
+	filterEmaShift = new std::vector<uint8_t>(maxNumberOfBoards);
+	filterEmaState = new std::vector<int32_t[MRM_REF_CAN_SENSOR_COUNT]>(maxNumberOfBoards);
+	filterMedianWindow = new std::vector<uint16_t[3][MRM_REF_CAN_SENSOR_COUNT]>(maxNumberOfBoards);
+	filterWindowNext = new std::vector<uint8_t>(maxNumberOfBoards);
+	_readingFiltered = new std::vector<uint16_t[MRM_REF_CAN_SENSOR_COUNT]>(maxNumberOfBoards);
+	for (uint8_t i = 0; i < maximumNumberOfBoards; i++) {
+		(*_filter)[i] = FILTER_NONE;
+		(*filterEmaShift)[i] = 2;
+		(*filterWindowNext)[i] = 0xFF;
+	}
+	peakHold = new std::vector<PeakHold>(maxNumberOfBoards);
+	for (uint8_t i = 0; i < maximumNumberOfBoards; i++)
+		peakHoldReadAndClear(NULL, NULL, NULL, i);
+	_health = new std::vector<uint8_t>(maxNumberOfBoards);
+	healthMs = new std::vector<uint32_t>(maxNumberOfBoards);
+	healthBackoffMs = new std::vector<uint16_t>(maxNumberOfBoards);
+	refreshMs = new std::vector<uint16_t>(maxNumberOfBoards);
+	for (uint8_t i = 0; i < maximumNumberOfBoards; i++) {
+		(*_health)[i] = HEALTH_ALIVE;
+		(*healthBackoffMs)[i] = MRM_REF_CAN_RETRY_FIRST_MS;
+	}
+	latencyFirstRead = new std::vector<LatencyHistogram>(maxNumberOfBoards);
+	latencyAge = new std::vector<LatencyHistogram>(maxNumberOfBoards);
+	readingsSetUs = new std::vector<std::atomic<uint32_t>>(maxNumberOfBoards);
+	for (uint8_t i = 0; i < maximumNumberOfBoards; i++)
+		(*readingsSetUs)[i].store(0);
 		
 	if (commandNamesSpecific == NULL){
 		commandNamesSpecific = new std::map<int, std::string>();
@@ -100,27 +162,7 @@ void Mrm_ref_can::add(char * deviceName)
 @return - started or not
 */
 bool Mrm_ref_can::analogStarted(uint8_t deviceNumber) {
-	if ((*_mode)[deviceNumber] != ANALOG_VALUES || millis() - devices[deviceNumber].lastReadingsMs > MRM_REF_CAN_INACTIVITY_ALLOWED_MS || devices[deviceNumber].lastReadingsMs == 0) {
-		//print("Start analog \n\r"); 
-		devices[deviceNumber].lastReadingsMs = 0;
-		for (uint8_t i = 0; i < 8; i++) { // 8 tries
-			start(&devices[deviceNumber], 0); // As analog
-			// Wait for 1. message.
-			uint32_t startMs = millis();
-			while (millis() - startMs < 50) {
-				if (millis() - devices[deviceNumber].lastReadingsMs < 100) {
-					//print("Analog confirmed\n\r"); 
-					(*_mode)[deviceNumber] = ANALOG_VALUES;
-					return true;
-				}
-				delayMs(1);
-			}
-		}
-		sprintf(errorMessage, "%s %i dead.", _boardsName.c_str(), deviceNumber);
-		return false;
-	}
-	else
-		return true;
+	return modeStarted(deviceNumber, ANALOG_VALUES);
 }
 
 /** Any dark or bright
@@ -141,8 +183,10 @@ bool Mrm_ref_can::any(bool dark, uint8_t deviceNumber, uint8_t fistTransistor, u
 	if ((*_transistorCount)[deviceNumber] < lastTransistor + 1)
 		lastTransistor = (*_transistorCount)[deviceNumber];
 
+	// Digital reading is 1 for dark in DIGITAL_AND_DARK_CENTER, for bright in DIGITAL_AND_BRIGHT_CENTER.
+	uint8_t wanted = dark == ((*_mode)[deviceNumber] == DIGITAL_AND_DARK_CENTER) ? 1 : 0;
 	for (uint8_t i = fistTransistor; i < lastTransistor; i++){
-		if ((*_reading)[deviceNumber][i] == (dark ? 1 : 0))
+		if ((*_reading)[deviceNumber][i] == wanted)
 				return true;
 	}
 	return false;
@@ -224,16 +268,19 @@ void Mrm_ref_can::calibrationDataRequest(uint8_t deviceNumber, bool waitForResul
 /** Print all calibration in a line
 */
 void Mrm_ref_can::calibrationPrint() {
+	char* bufferEnd = printBuffer + MRM_REF_CAN_PRINT_BUFFER_SIZE - 1;
 	for (Device& device: devices)
 		if (device.alive) {
-			print("Calibration for %s.\n\r", name().c_str());
-			print("Dark: ");
+			aliveWithOptionalScan(&device);
+			char* p = printAppend(printBuffer, bufferEnd, "Calibration for ");
+			p = printAppend(p, bufferEnd, name().c_str());
+			p = printAppend(p, bufferEnd, ".\n\rDark: ");
 			for (uint8_t irNo = 0; irNo < MRM_REF_CAN_SENSOR_COUNT; irNo++)
-				print(" %3i", calibrationDataGet(irNo, true, device.number));
-			print("\n\rBright: ");
+				p = printAppend(printAppend(p, bufferEnd, " "), bufferEnd, (*calibrationDataDark)[device.number][irNo], 3);
+			p = printAppend(p, bufferEnd, "\n\rBright: ");
 			for (uint8_t irNo = 0; irNo < MRM_REF_CAN_SENSOR_COUNT; irNo++)
-				print(" %3i", calibrationDataGet(irNo, false, device.number));
-			print("\n\r");
+				p = printAppend(printAppend(p, bufferEnd, " "), bufferEnd, (*calibrationDataBright)[device.number][irNo], 3);
+			printBufferFlush(printAppend(p, bufferEnd, "\n\r"));
 		}
 }
 
@@ -243,8 +290,11 @@ void Mrm_ref_can::calibrationPrint() {
 @return - 1000 - 9000. 1000 means center exactly under first phototransistor (denoted with "1" on the printed circuit board), 5000 is center transistor.
 */
 uint16_t Mrm_ref_can::center(uint8_t deviceNumber, bool ofDark) { 
-	if (digitalStarted(deviceNumber, ofDark))
+	if (digitalStarted(deviceNumber, ofDark)) {
+		if (latencyEnabled)
+			latencyRecord(deviceNumber);
 		return (*centerOfMeasurements)[deviceNumber];
+	}
 	else
 		return false;
 }
@@ -265,10 +315,15 @@ std::string Mrm_ref_can::commandName(uint8_t byte){
 @return - yes or no.
 */
 bool Mrm_ref_can::dark(uint8_t receiverNumberInSensor, uint8_t deviceNumber, bool fromAnalog) {
+	if (healthBlocked(deviceNumber))
+		return false;
 	aliveWithOptionalScan(&devices[deviceNumber], true);
 	if (fromAnalog) {// Analog readings
-		if (analogStarted(deviceNumber))
-			return (*_reading)[deviceNumber][receiverNumberInSensor] < ((*calibrationDataDark)[deviceNumber][receiverNumberInSensor] + (*calibrationDataBright)[deviceNumber][receiverNumberInSensor]) / 2;
+		if (analogStarted(deviceNumber)) {
+			if (latencyEnabled)
+				latencyRecord(deviceNumber);
+			return (*_readingFiltered)[deviceNumber][receiverNumberInSensor] < ((*calibrationDataDark)[deviceNumber][receiverNumberInSensor] + (*calibrationDataBright)[deviceNumber][receiverNumberInSensor]) / 2;
+		}
 		else
 			return false;
 	}
@@ -276,6 +331,8 @@ bool Mrm_ref_can::dark(uint8_t receiverNumberInSensor, uint8_t deviceNumber, boo
 		if (!digitalStarted(deviceNumber, false, false) && !digitalStarted(deviceNumber, true, false))
 			if (!digitalStarted(deviceNumber, true))
 				return false;
+		if (latencyEnabled)
+			latencyRecord(deviceNumber);
 		if ((*_mode)[deviceNumber] == DIGITAL_AND_DARK_CENTER) 
 			return (*_reading)[deviceNumber][receiverNumberInSensor] == 1;
 		else
@@ -321,29 +378,227 @@ void Mrm_ref_can::dataFreshReadingsSet(bool setToFresh, uint8_t deviceNumber) {
 @return - started or not
 */
 bool Mrm_ref_can::digitalStarted(uint8_t deviceNumber, bool darkCenter, bool startIfNot) {
-	if ((*_mode)[deviceNumber] != DIGITAL_AND_DARK_CENTER || millis() - devices[deviceNumber].lastReadingsMs > MRM_REF_CAN_INACTIVITY_ALLOWED_MS || devices[deviceNumber].lastReadingsMs == 0) {
-		if (startIfNot) {
-			//print("Digital started, dark: %i \n\r", darkCenter); 
-			devices[deviceNumber].lastReadingsMs = 0;
-			for (uint8_t i = 0; i < 8; i++) { // 8 tries
-				start(&devices[deviceNumber], darkCenter ? 1 : 2); // As digital with dark or bright center
-				// Wait for 1. message.
-				uint32_t startMs = millis();
-				while (millis() - startMs < 50) {
-					if (millis() - devices[deviceNumber].lastReadingsMs < 100) {
-						//print("Digital confirmed\n\r"); 
-						(*_mode)[deviceNumber] = darkCenter ? DIGITAL_AND_DARK_CENTER : DIGITAL_AND_BRIGHT_CENTER;
-						return true;
-					}
-					delayMs(1);
-				}
-			}
-			sprintf(errorMessage, "%s %i dead.", _boardsName.c_str(), deviceNumber);
+	return modeStarted(deviceNumber, darkCenter ? DIGITAL_AND_DARK_CENTER : DIGITAL_AND_BRIGHT_CENTER, startIfNot);
+}
+
+/** Filter the last complete set of analog readings, all transistors at once
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+*/
+void Mrm_ref_can::filterApply(uint8_t deviceNumber) {
+	// Loops have a fixed count, no branches and contiguous data, so the compiler can vectorize them.
+	const uint16_t* raw = (*_reading)[deviceNumber];
+	uint16_t* filtered = (*_readingFiltered)[deviceNumber];
+	uint8_t filter = (*_filter)[deviceNumber];
+	uint8_t& next = (*filterWindowNext)[deviceNumber];
+	bool primed = next != 0xFF;
+
+	uint16_t median[MRM_REF_CAN_SENSOR_COUNT];
+	const uint16_t* input = raw;
+	if (filter == FILTER_MEDIAN || filter == FILTER_MEDIAN_AND_EMA) {
+		uint16_t (*window)[MRM_REF_CAN_SENSOR_COUNT] = (*filterMedianWindow)[deviceNumber];
+		if (primed) {
+			memcpy(window[next], raw, sizeof(window[0]));
+			next = next == 2 ? 0 : next + 1;
 		}
-		return false;
+		else // Fill the whole window with the first set so that median is valid at once.
+			for (uint8_t row = 0; row < 3; row++)
+				memcpy(window[row], raw, sizeof(window[0]));
+		for (uint8_t i = 0; i < MRM_REF_CAN_SENSOR_COUNT; i++) {
+			uint16_t a = window[0][i], b = window[1][i], c = window[2][i];
+			median[i] = std::max(std::min(a, b), std::min(std::max(a, b), c));
+		}
+		input = median;
+	}
+
+	if (filter == FILTER_EMA || filter == FILTER_MEDIAN_AND_EMA) {
+		int32_t* state = (*filterEmaState)[deviceNumber];
+		uint8_t shift = (*filterEmaShift)[deviceNumber];
+		if (primed)
+			for (uint8_t i = 0; i < MRM_REF_CAN_SENSOR_COUNT; i++)
+				state[i] += (((int32_t)input[i] << 8) - state[i]) >> shift;
+		else
+			for (uint8_t i = 0; i < MRM_REF_CAN_SENSOR_COUNT; i++)
+				state[i] = (int32_t)input[i] << 8;
+		for (uint8_t i = 0; i < MRM_REF_CAN_SENSOR_COUNT; i++)
+			filtered[i] = (uint16_t)((state[i] + 128) >> 8);
 	}
 	else
+		memcpy(filtered, input, sizeof(uint16_t) * MRM_REF_CAN_SENSOR_COUNT);
+
+	if (!primed)
+		next = 0;
+}
+
+/** Sets filter applied to analog readings when a set of all transistors arrives
+@param type - FILTER_EMA: exponential moving average, FILTER_MEDIAN: median of last 3 sets (spike rejection), FILTER_MEDIAN_AND_EMA: median first, then average.
+@param emaShift - smoothing factor of the average is 1 / 2^emaShift, 1 - 7. Bigger is smoother, but slower.
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0. 0xFF - all sensors.
+*/
+void Mrm_ref_can::filterSet(FilterType type, uint8_t emaShift, uint8_t deviceNumber) {
+	if (deviceNumber == 0xFF)
+		for (uint8_t i = 0; i < maximumNumberOfBoards; i++)
+			filterSet(type, emaShift, i);
+	else if (deviceNumber < maximumNumberOfBoards) {
+		if (emaShift < 1)
+			emaShift = 1;
+		else if (emaShift > 7)
+			emaShift = 7;
+		(*_filter)[deviceNumber] = type;
+		(*filterEmaShift)[deviceNumber] = emaShift;
+		(*filterWindowNext)[deviceNumber] = 0xFF;
+	}
+}
+
+/** Health of the device. Dead devices are restarted with exponential backoff, without blocking.
+Each call, as well as any accessor, advances the state machine, so calling healthCheck() in the main loop keeps restarting dead devices.
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+@return - HEALTH_ALIVE, HEALTH_SUSPECT (readings late, not returned), HEALTH_DEAD (readings stopped or start failed, waiting for next attempt), HEALTH_RECOVERING (start sent, waiting for readings)
+*/
+Mrm_ref_can::Health Mrm_ref_can::health(uint8_t deviceNumber) {
+	if (deviceNumber >= nextFree)
+		return HEALTH_DEAD;
+	healthUpdate(deviceNumber);
+	return (Health)(*_health)[deviceNumber];
+}
+
+/** Dead or recovering, waiting for restart attempt. Accessors must return at once.
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+@return - blocked or not
+*/
+bool Mrm_ref_can::healthBlocked(uint8_t deviceNumber) {
+	healthUpdate(deviceNumber);
+	switch ((*_health)[deviceNumber]) {
+	case HEALTH_DEAD:
+		return millis() - (*healthMs)[deviceNumber] < (*healthBackoffMs)[deviceNumber];
+	case HEALTH_RECOVERING:
 		return true;
+	default:
+		return false;
+	}
+}
+
+/** Advance health state machine and restart dead devices whose backoff expired. Never blocks.
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0. 0xFF - all sensors.
+*/
+void Mrm_ref_can::healthCheck(uint8_t deviceNumber) {
+	if (deviceNumber == 0xFF)
+		for (uint8_t i = 0; i < nextFree; i++)
+			healthCheck(i);
+	else if (deviceNumber < nextFree && (*_health)[deviceNumber] >= HEALTH_DEAD && !healthBlocked(deviceNumber))
+		modeStarted(deviceNumber, (mode)(*_mode)[deviceNumber]);
+}
+
+/** Change health and notify
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+@param newHealth - new state
+*/
+void Mrm_ref_can::healthSet(uint8_t deviceNumber, uint8_t newHealth) {
+	uint8_t oldHealth = (*_health)[deviceNumber];
+	if (oldHealth == newHealth)
+		return;
+	(*_health)[deviceNumber] = newHealth;
+	if (newHealth == HEALTH_DEAD || newHealth == HEALTH_RECOVERING)
+		(*healthMs)[deviceNumber] = millis();
+	if (newHealth == HEALTH_ALIVE)
+		(*healthBackoffMs)[deviceNumber] = MRM_REF_CAN_RETRY_FIRST_MS;
+	if (healthNotification != NULL)
+		healthNotification(deviceNumber, oldHealth, newHealth);
+}
+
+/** Transitions driven by readings' arrival
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+*/
+void Mrm_ref_can::healthUpdate(uint8_t deviceNumber) {
+	uint32_t lastMs = devices[deviceNumber].lastReadingsMs;
+	uint32_t lateMs = std::max((uint32_t)MRM_REF_CAN_SUSPECT_MS, 3 * (uint32_t)(*refreshMs)[deviceNumber]);
+	bool recent = lastMs != 0 && millis() - lastMs < lateMs;
+	uint8_t health = (*_health)[deviceNumber];
+	if (recent) {
+		if (health != HEALTH_ALIVE)
+			healthSet(deviceNumber, HEALTH_ALIVE);
+		return;
+	}
+	if (health == HEALTH_ALIVE && lastMs != 0) { // lastMs is 0 while blocking start waits for the 1. message.
+		health = HEALTH_SUSPECT;
+		healthSet(deviceNumber, health);
+	}
+	if (health == HEALTH_SUSPECT && millis() - lastMs >= lateMs * MRM_REF_CAN_DEAD_PERIODS)
+		healthSet(deviceNumber, HEALTH_DEAD);
+	else if (health == HEALTH_RECOVERING && millis() - (*healthMs)[deviceNumber] > lateMs)
+		healthSet(deviceNumber, HEALTH_DEAD);
+}
+
+/** Add a latency to histogram
+@param us - latency in microseconds
+*/
+void Mrm_ref_can::LatencyHistogram::add(uint32_t us) {
+	uint8_t bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+	if (bucket >= MRM_REF_CAN_LATENCY_BUCKETS)
+		bucket = MRM_REF_CAN_LATENCY_BUCKETS - 1;
+	count[bucket]++;
+}
+
+/** Latency percentile
+@param percent - 0 - 100
+@return - latency is below this, in microseconds, a power of 2. 0xFFFFFFFF - in the last bucket, unbounded. 0 - no data.
+*/
+uint32_t Mrm_ref_can::LatencyHistogram::percentile(uint8_t percent) const {
+	uint64_t total = 0;
+	for (uint8_t i = 0; i < MRM_REF_CAN_LATENCY_BUCKETS; i++)
+		total += count[i];
+	if (total == 0)
+		return 0;
+	uint64_t needed = (total * std::min(percent, (uint8_t)100) + 99) / 100; // Rounded up, at least 1 for any percent > 0
+	if (needed == 0)
+		needed = 1;
+	uint64_t sum = 0;
+	for (uint8_t i = 0; i < MRM_REF_CAN_LATENCY_BUCKETS; i++) {
+		sum += count[i];
+		if (sum >= needed)
+			return i == MRM_REF_CAN_LATENCY_BUCKETS - 1 ? 0xFFFFFFFF : 1UL << i;
+	}
+	return 0xFFFFFFFF;
+}
+
+/** Clear latency histograms
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0. 0xFF - all sensors.
+*/
+void Mrm_ref_can::latencyClear(uint8_t deviceNumber) {
+	if (deviceNumber == 0xFF)
+		for (uint8_t i = 0; i < maximumNumberOfBoards; i++)
+			latencyClear(i);
+	else if (deviceNumber < maximumNumberOfBoards) {
+		memset((*latencyFirstRead)[deviceNumber].count, 0, sizeof(LatencyHistogram::count));
+		memset((*latencyAge)[deviceNumber].count, 0, sizeof(LatencyHistogram::count));
+	}
+}
+
+/** Latency percentile
+@param percent - 0 - 100, for example 50 for median, 99 for worst but 1%.
+@param firstRead - from arrival of the last frame of a readings set to its first read by reading(), dark(), center(),... Otherwise age of readings on every read.
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+@return - latency is below this, in microseconds, a power of 2 (1 - below 1 us). 0xFFFFFFFF - longer than the last bucket's start. 0 - no data.
+*/
+uint32_t Mrm_ref_can::latencyPercentile(uint8_t percent, bool firstRead, uint8_t deviceNumber) {
+	if (deviceNumber >= maximumNumberOfBoards) {
+		sprintf(errorMessage, "%s %i doesn't exist.", _boardsName.c_str(), deviceNumber);
+		return 0;
+	}
+	return (firstRead ? (*latencyFirstRead) : (*latencyAge))[deviceNumber].percentile(percent);
+}
+
+/** Record age of readings on read. Call only if latencyEnabled.
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+*/
+void Mrm_ref_can::latencyRecord(uint8_t deviceNumber) {
+	uint32_t setUs = (*readingsSetUs)[deviceNumber].load();
+	if (setUs == 0)
+		return;
+	uint32_t age = micros() - (setUs & ~1UL);
+	(*latencyAge)[deviceNumber].add(age);
+	// Clear unread flag only if no new set arrived meanwhile. Otherwise the new one stays unread for the next read.
+	if ((setUs & 1) && (*readingsSetUs)[deviceNumber].compare_exchange_strong(setUs, setUs & ~1UL))
+		(*latencyFirstRead)[deviceNumber].add(age);
 }
 
 /** Read CAN Bus message into local variables
@@ -359,6 +614,7 @@ for (Device& device : devices)
 				bool anyReading = false;
 				bool anyCalibrationDataDark = false;
 				bool anyCalibrationDataBright = false;
+				bool readingsSetComplete = false;
 				uint8_t startIndex = 0;
 				switch (message.data[0]) {
 				case COMMAND_REF_CAN_CALIBRATION_DATA_DARK_1_TO_3:
@@ -404,6 +660,9 @@ for (Device& device : devices)
 					anyReading = true;
 					(*dataFresh)[device.number] |= 0b00100000;
 					device.lastReadingsMs = millis();
+					readingsSetComplete = true;
+					if (latencyEnabled)
+						(*readingsSetUs)[device.number].store(micros() | 1); // Unread
 					break;
 				case COMMAND_REF_CAN_SENDING_SENSORS_CENTER:
 					(*centerOfMeasurements)[device.number] = (uint16_t)((message.data[2] << 8) | message.data[1]);
@@ -417,17 +676,31 @@ for (Device& device : devices)
 					(*_reading)[device.number][6] = (message.data[3] & 0b00000010) >> 1;
 					(*_reading)[device.number][7] = message.data[3] & 0b00000001;
 					(*_reading)[device.number][8] = message.data[4];
+					{
+						uint16_t darkBits = 0;
+						for (uint8_t i = 0; i < MRM_REF_CAN_SENSOR_COUNT; i++)
+							if ((*_reading)[device.number][i] == ((*_mode)[device.number] == DIGITAL_AND_DARK_CENTER ? 1 : 0))
+								darkBits |= 1 << i;
+						(*peakHold)[device.number].digitalDark.fetch_or(darkBits);
+					}
 
 					(*dataFresh)[device.number] |= 0b11100000;
 					device.lastReadingsMs = millis();
+					if (latencyEnabled)
+						(*readingsSetUs)[device.number].store(micros() | 1); // Unread
 					break;
 				default:
 					errorAdd(message, ERROR_COMMAND_UNKNOWN, false, true);
 				}
 
 				if (anyReading)
-					for (uint8_t i = 0; i <= 2; i++)
+					for (uint8_t i = 0; i <= 2; i++) {
 						(*_reading)[device.number][startIndex + i] = (message.data[2 * i + 1] << 8) | message.data[2 * i + 2];
+						peakHoldUpdate(device.number, startIndex + i, (*_reading)[device.number][startIndex + i]);
+					}
+
+				if (readingsSetComplete)
+					filterApply(device.number);
 
 				if (anyCalibrationDataBright)
 					for (uint8_t i = 0; i <= 2; i++)
@@ -443,6 +716,109 @@ for (Device& device : devices)
 	return false;
 }
 
+/** Peaks recorded locally since the last call, then cleared. Unlike peakRecordingSet(), catches extremes of all the frames, even if polled slower than sensor's refresh rate.
+Lock-free, safe to call while messageDecode() runs on another core: maximum and minimum of each transistor are taken together, so a reading arriving meanwhile ends whole either in this result or in the next one.
+@param maximum - output, MRM_REF_CAN_SENSOR_COUNT elements, maximum analog readings. 0 if no analog reading. NULL - not needed.
+@param minimum - output, MRM_REF_CAN_SENSOR_COUNT elements, minimum analog readings. 0xFFFF if no analog reading. NULL - not needed.
+@param darkSeen - output, bit i set if transistor i was dark at least once: in digital readings or minimum analog below calibration's middle. NULL - not needed.
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+@return - any reading arrived or any dark seen
+*/
+bool Mrm_ref_can::peakHoldReadAndClear(uint16_t* maximum, uint16_t* minimum, uint16_t* darkSeen, uint8_t deviceNumber) {
+	if (deviceNumber >= maximumNumberOfBoards) {
+		sprintf(errorMessage, "%s %i doesn't exist.", _boardsName.c_str(), deviceNumber);
+		return false;
+	}
+	PeakHold& peak = (*peakHold)[deviceNumber];
+	bool any = false;
+	uint16_t dark = 0;
+	for (uint8_t i = 0; i < MRM_REF_CAN_SENSOR_COUNT; i++) {
+		uint32_t extremes = peak.extremes[i].exchange(MRM_REF_CAN_PEAK_CLEARED);
+		uint16_t max = extremes >> 16;
+		uint16_t min = extremes & 0xFFFF;
+		if (min <= max) {
+			any = true;
+			// Dark the same way as dark() with analog values.
+			if (min < ((*calibrationDataDark)[deviceNumber][i] + (*calibrationDataBright)[deviceNumber][i]) / 2)
+				dark |= 1 << i;
+		}
+		if (maximum != NULL)
+			maximum[i] = max;
+		if (minimum != NULL)
+			minimum[i] = min;
+	}
+	dark |= peak.digitalDark.exchange(0);
+	if (darkSeen != NULL)
+		*darkSeen = dark;
+	return any || dark != 0;
+}
+
+/** If mode not started, start it. Alive device: wait for 1. message. Suspect or dead: only a single, non-blocking attempt, for dead when backoff expires.
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+@param newMode - ANALOG_VALUES, DIGITAL_AND_BRIGHT_CENTER or DIGITAL_AND_DARK_CENTER
+@param startIfNot - If not already started, start now.
+@return - started or not
+*/
+bool Mrm_ref_can::modeStarted(uint8_t deviceNumber, mode newMode, bool startIfNot) {
+	healthUpdate(deviceNumber);
+	uint8_t health = (*_health)[deviceNumber];
+	// Only an alive device's readings are live. A suspect one's are stale, so not returned.
+	if ((*_mode)[deviceNumber] == newMode && health == HEALTH_ALIVE && devices[deviceNumber].lastReadingsMs != 0)
+		return true;
+	if (!startIfNot || healthBlocked(deviceNumber))
+		return false;
+	if (health == HEALTH_SUSPECT && (*_mode)[deviceNumber] == newMode) // Already started, wait for readings or death, without blocking.
+		return false;
+
+	uint8_t startMode = newMode == ANALOG_VALUES ? 0 : (newMode == DIGITAL_AND_DARK_CENTER ? 1 : 2); // As analog, digital with dark center or with bright center
+	if (newMode == ANALOG_VALUES)
+		(*filterWindowNext)[deviceNumber] = 0xFF; // Old filter state is stale
+
+	// Mode set before start(), so that messageDecode() interprets the first frames in the new mode.
+	(*_mode)[deviceNumber] = newMode;
+	if (health != HEALTH_ALIVE) { // Single attempt, readings' arrival will be detected by healthUpdate().
+		start(&devices[deviceNumber], startMode);
+		if (health == HEALTH_DEAD)
+			(*healthBackoffMs)[deviceNumber] = std::min((*healthBackoffMs)[deviceNumber] * 2, MRM_REF_CAN_RETRY_MAX_MS);
+		healthSet(deviceNumber, HEALTH_RECOVERING);
+		return false;
+	}
+
+	devices[deviceNumber].lastReadingsMs = 0;
+	for (uint8_t i = 0; i < 8; i++) { // 8 tries
+		start(&devices[deviceNumber], startMode);
+		// Wait for 1. message.
+		uint32_t startMs = millis();
+		while (millis() - startMs < 50) {
+			if (millis() - devices[deviceNumber].lastReadingsMs < 100) {
+				healthSet(deviceNumber, HEALTH_ALIVE);
+				return true;
+			}
+			delayMs(1);
+		}
+	}
+	sprintf(errorMessage, "%s %i dead.", _boardsName.c_str(), deviceNumber);
+	healthSet(deviceNumber, HEALTH_DEAD);
+	return false;
+}
+
+/** Add a new reading to peak accumulators
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+@param receiverNumberInSensor - single IR transistor in mrm-ref-can
+@param value - analog reading
+*/
+void Mrm_ref_can::peakHoldUpdate(uint8_t deviceNumber, uint8_t receiverNumberInSensor, uint16_t value) {
+	std::atomic<uint32_t>& extremes = (*peakHold)[deviceNumber].extremes[receiverNumberInSensor];
+	// Compare-and-swap, not store, so that a concurrent clear is never overwritten with an old peak.
+	uint32_t old = extremes.load();
+	uint32_t updated;
+	do {
+		uint16_t max = std::max((uint16_t)(old >> 16), value);
+		uint16_t min = std::min((uint16_t)(old & 0xFFFF), value);
+		updated = ((uint32_t)max << 16) | min;
+	} while (updated != old && !extremes.compare_exchange_weak(old, updated));
+}
+
 /** Sets recording of peaks between refreshes
  * 
 */
@@ -459,32 +835,100 @@ void Mrm_ref_can::peakRecordingSet(RecordPeakType type, uint8_t deviceNumber){
 }
 
 
-/** Analog readings
+/** Print printBuffer in chunks no longer than MRM_REF_CAN_PRINT_CHUNK
+@param end - terminating 0 of the text in printBuffer
+*/
+void Mrm_ref_can::printBufferFlush(char* end) {
+	for (char* chunk = printBuffer; chunk < end; chunk += MRM_REF_CAN_PRINT_CHUNK) {
+		char* chunkEnd = std::min(chunk + MRM_REF_CAN_PRINT_CHUNK, end);
+		char saved = *chunkEnd;
+		*chunkEnd = 0;
+		print("%s", chunk);
+		*chunkEnd = saved;
+	}
+}
+
+/** Analog readings, filtered if filterSet() chose a filter
 @param receiverNumberInSensor - single IR transistor in mrm-ref-can
 @param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 @return - analog value
 */
 uint16_t Mrm_ref_can::reading(uint8_t receiverNumberInSensor, uint8_t deviceNumber){
-	if (deviceNumber >= nextFree || receiverNumberInSensor > MRM_REF_CAN_SENSOR_COUNT) {
+	if (deviceNumber >= nextFree || receiverNumberInSensor >= MRM_REF_CAN_SENSOR_COUNT) {
+		sprintf(errorMessage, "%s %i doesn't exist.", _boardsName.c_str(), deviceNumber);
+		return 0;
+	}
+	if (healthBlocked(deviceNumber))
+		return 0;
+	aliveWithOptionalScan(&devices[deviceNumber], true);
+	if (analogStarted(deviceNumber)) {
+		if (latencyEnabled)
+			latencyRecord(deviceNumber);
+		return (*_readingFiltered)[deviceNumber][receiverNumberInSensor];
+	}
+	else
+		return 0;
+}
+
+/** Analog readings, not filtered
+@param receiverNumberInSensor - single IR transistor in mrm-ref-can
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+@return - analog value
+*/
+uint16_t Mrm_ref_can::readingRaw(uint8_t receiverNumberInSensor, uint8_t deviceNumber){
+	if (deviceNumber >= nextFree || receiverNumberInSensor >= MRM_REF_CAN_SENSOR_COUNT) {
 		sprintf(errorMessage, "%s %i doesn't exist.", _boardsName.c_str(), deviceNumber);
 		return 0;
 	}
+	if (healthBlocked(deviceNumber))
+		return 0;
 	aliveWithOptionalScan(&devices[deviceNumber], true);
-	if (analogStarted(deviceNumber))
+	if (analogStarted(deviceNumber)) {
+		if (latencyEnabled)
+			latencyRecord(deviceNumber);
 		return (*_reading)[deviceNumber][receiverNumberInSensor];
+	}
 	else
 		return 0;
 }
 
+/** All analog readings of a device in one call
+@param values - output, MRM_REF_CAN_SENSOR_COUNT elements
+@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+@param filtered - filtered values. Otherwise raw.
+@return - readings valid
+*/
+bool Mrm_ref_can::readings(uint16_t values[MRM_REF_CAN_SENSOR_COUNT], uint8_t deviceNumber, bool filtered){
+	if (deviceNumber >= nextFree) {
+		sprintf(errorMessage, "%s %i doesn't exist.", _boardsName.c_str(), deviceNumber);
+		return false;
+	}
+	if (!healthBlocked(deviceNumber)) {
+		aliveWithOptionalScan(&devices[deviceNumber], true);
+		if (analogStarted(deviceNumber)) {
+			if (latencyEnabled)
+				latencyRecord(deviceNumber);
+			memcpy(values, filtered ? (*_readingFiltered)[deviceNumber] : (*_reading)[deviceNumber], sizeof(uint16_t) * MRM_REF_CAN_SENSOR_COUNT);
+			return true;
+		}
+	}
+	memset(values, 0, sizeof(uint16_t) * MRM_REF_CAN_SENSOR_COUNT);
+	return false;
+}
+
 /** Print all analog readings in a line
 */
 void Mrm_ref_can::readingsPrint() {
-	print("Refl:");
-	for (Device& device: devices) {
-		for (uint8_t irNo = 0; irNo < std::min(MRM_REF_CAN_SENSOR_COUNT, (int)(*_transistorCount)[device.number]); irNo++)
-			if (device.alive)
-				print("%3i ", reading(irNo, device.number));
-	}
+	char* bufferEnd = printBuffer + MRM_REF_CAN_PRINT_BUFFER_SIZE - 1;
+	char* p = printAppend(printBuffer, bufferEnd, "Refl:");
+	uint16_t values[MRM_REF_CAN_SENSOR_COUNT];
+	for (Device& device: devices)
+		if (device.alive) {
+			readings(values, device.number);
+			for (uint8_t irNo = 0; irNo < std::min(MRM_REF_CAN_SENSOR_COUNT, (int)(*_transistorCount)[device.number]); irNo++)
+				p = printAppend(printAppend(p, bufferEnd, values[irNo], 3), bufferEnd, " ");
+		}
+	printBufferFlush(p);
 }
 
 /** Sets refresh rate for sensor 
@@ -495,6 +939,7 @@ void Mrm_ref_can::refreshSet(uint16_t ms, uint8_t deviceNumber){
 		for (uint8_t i = 0; i < nextFree; i++)
 			refreshSet(ms, i);
 	else if (aliveWithOptionalScan(&devices[deviceNumber])) {
+		(*refreshMs)[deviceNumber] = ms;
 		delay(1);
 		canData[0] = COMMAND_REF_CAN_REFRESH_MS;
 		canData[1] = ms & 0xFF;
@@ -517,29 +962,33 @@ void Mrm_ref_can::test(bool analog)
 	cnt++;
 #endif
 	if (millis() - lastMs > 300) {//300
+		char* bufferEnd = printBuffer + MRM_REF_CAN_PRINT_BUFFER_SIZE - 1;
+		char* p = printBuffer;
+		*p = 0;
 		uint8_t pass = 0;
 		for (Device& device: devices) {
 			if (device.alive) {
 				if (pass++)
-					print("| ");
+					p = printAppend(p, bufferEnd, "| ");
 				for (uint8_t i = 0; i < std::min(MRM_REF_CAN_SENSOR_COUNT, (int)(*_transistorCount)[device.number]); i++){
-					print(analog ? "%3i " : "%i", analog ? reading(i, device.number) : dark(i, device.number));
+					uint16_t value = analog ? reading(i, device.number) : dark(i, device.number);
+					p = analog ? printAppend(printAppend(p, bufferEnd, value, 3), bufferEnd, " ") : printAppend(p, bufferEnd, value);
 #if TEST_REF_CAN_FOR_0
-					if (reading(i, device.number) == 0 && cnt > 10){ // At startup some zero, that's ok
+					if (analog && value == 0 && cnt > 10){ // At startup some zero, that's ok
 
 						end();
 					}
 #endif
 				}
 				if (!analog)
-					print(" c:%i", center(device.number, (*_mode)[device.number] == DIGITAL_AND_DARK_CENTER));
+					p = printAppend(printAppend(p, bufferEnd, " c:"), bufferEnd, center(device.number, (*_mode)[device.number] == DIGITAL_AND_DARK_CENTER));
 
 			}
-			delay(1);
 		}
 		lastMs = millis();
-		if (pass)
-			print("\n\r");
+		if (pass) {
+			printBufferFlush(printAppend(p, bufferEnd, "\n\r"));
+		}
 	}
 }
 
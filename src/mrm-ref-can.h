@@ -2,6 +2,7 @@
 #include "Arduino.h"
 #include <mrm-board.h>
 #include <map>
+#include <atomic>
 
 /**
 Purpose: mrm-ref-can interface to CANBus.
@@ -48,7 +49,14 @@ Licence: You can use this code any way you like.
 #define COMMAND_REF_CAN_RECORD_PEAK 0x54
 #define COMMAND_REF_CAN_REFRESH_MS 0x55
 
-#define MRM_REF_CAN_INACTIVITY_ALLOWED_MS 10000
+#define MRM_REF_CAN_SUSPECT_MS 200 // No readings for this long (at least 3 refresh periods): suspect.
+#define MRM_REF_CAN_DEAD_PERIODS 5 // Dead when no readings for this many late periods. Late period is MRM_REF_CAN_SUSPECT_MS or 3 refresh periods, whichever is longer.
+#define MRM_REF_CAN_RETRY_FIRST_MS 100 // Dead board's first restart attempt after this delay, then doubled with each attempt.
+#define MRM_REF_CAN_RETRY_MAX_MS 5000 // Longest delay between restart attempts.
+#define MRM_REF_CAN_PRINT_BUFFER_SIZE 640 // A whole line of readingsPrint(), calibrationPrint() or test(), for 8 devices.
+#define MRM_REF_CAN_PRINT_CHUNK 64 // Longest text in a single print(). print() formats it again into mrm-board's own fixed buffer, whose size is not known here.
+#define MRM_REF_CAN_PEAK_CLEARED 0x0000FFFF // Peak accumulator with maximum 0 and minimum 0xFFFF.
+#define MRM_REF_CAN_LATENCY_BUCKETS 24 // Latency histogram's buckets. Bucket 0 holds 0 microseconds, bucket i > 0 2^(i-1) to 2^i - 1, the last one also all longer.
 
 class Mrm_ref_can : public SensorBoard
 {
@@ -69,6 +77,41 @@ class Mrm_ref_can : public SensorBoard
 	std::vector<uint16_t[MRM_REF_CAN_SENSOR_COUNT]>* _reading; // Analog or digital readings of all sensors, depending on measuring mode.
 																// When digital, 0 is bright and 1 is dark
 	std::vector<uint8_t>* _transistorCount;
+	std::vector<uint8_t>* _filter; // FilterType of each device.
+	std::vector<uint8_t>* filterEmaShift; // Exponential moving average's smoothing factor is 1 / 2^filterEmaShift.
+	std::vector<int32_t[MRM_REF_CAN_SENSOR_COUNT]>* filterEmaState; // Exponential moving average, fixed point with 8 fractional bits.
+	std::vector<uint16_t[3][MRM_REF_CAN_SENSOR_COUNT]>* filterMedianWindow; // Last 3 analog readings sets, one row per set, for median of 3.
+	std::vector<uint8_t>* filterWindowNext; // Row in filterMedianWindow to be overwritten next. 0xFF - filter not primed with the first set yet.
+	std::vector<uint16_t[MRM_REF_CAN_SENSOR_COUNT]>* _readingFiltered; // Analog readings after filter, refreshed once per complete set.
+
+	// Peaks between 2 consumer's polls. Written by messageDecode(), read and cleared by peakHoldReadAndClear(), possibly on different cores.
+	// Maximum and minimum share one 32-bit word, native atomic width of ESP32, so that both are taken and cleared in one step.
+	struct PeakHold {
+		std::atomic<uint32_t> extremes[MRM_REF_CAN_SENSOR_COUNT]; // Maximum in upper 16 bits, minimum in lower. MRM_REF_CAN_PEAK_CLEARED when cleared.
+		std::atomic<uint32_t> digitalDark; // Bit i set: transistor i was dark at least once in digital readings. Analog dark is derived from minimum.
+	};
+	std::vector<PeakHold>* peakHold;
+
+	std::vector<uint8_t>* _health; // Health of each device.
+	std::vector<uint32_t>* healthMs; // millis() of the last change to dead or recovering.
+	std::vector<uint16_t>* healthBackoffMs; // Delay before the next restart attempt of a dead device.
+	std::vector<uint16_t>* refreshMs; // Refresh period set by refreshSet(), 0 if not set.
+	void (*healthNotification)(uint8_t deviceNumber, uint8_t oldHealth, uint8_t newHealth) = NULL;
+
+	// Log-scale histogram of latencies in microseconds
+	struct LatencyHistogram {
+		uint32_t count[MRM_REF_CAN_LATENCY_BUCKETS];
+		void add(uint32_t us);
+		uint32_t percentile(uint8_t percent) const;
+	};
+	bool latencyEnabled = false;
+	std::vector<LatencyHistogram>* latencyFirstRead; // From the last frame of a readings set to the first read of that set.
+	std::vector<LatencyHistogram>* latencyAge; // Age of readings on each read.
+	// micros() when the last frame of a readings set arrived, with bit 0 set while the set is not read yet. 0 - none yet.
+	// One atomic word, so that messageDecode() and a reader on another core never split the time from its flag.
+	std::vector<std::atomic<uint32_t>>* readingsSetUs;
+
+	char printBuffer[MRM_REF_CAN_PRINT_BUFFER_SIZE]; // Line formatted here and printed with a few print() calls, in chunks of MRM_REF_CAN_PRINT_CHUNK.
 
 	/** If analog mode not started, start it and wait for 1. message
 	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
@@ -100,6 +143,53 @@ class Mrm_ref_can : public SensorBoard
 	*/
 	void dataFreshReadingsSet(bool setToFresh, uint8_t deviceNumber = 0);
 
+	/** Filter the last complete set of analog readings, all transistors at once
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	*/
+	void filterApply(uint8_t deviceNumber);
+
+	/** Dead or recovering, waiting for restart attempt. Accessors must return at once.
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	@return - blocked or not
+	*/
+	bool healthBlocked(uint8_t deviceNumber);
+
+	/** Change health and notify
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	@param newHealth - new state
+	*/
+	void healthSet(uint8_t deviceNumber, uint8_t newHealth);
+
+	/** Transitions driven by readings' arrival
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	*/
+	void healthUpdate(uint8_t deviceNumber);
+
+	/** Record age of readings on read. Call only if latencyEnabled.
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	*/
+	void latencyRecord(uint8_t deviceNumber);
+
+	/** If mode not started, start it. Alive device: wait for 1. message. Suspect or dead: only a single, non-blocking attempt, for dead when backoff expires.
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	@param newMode - ANALOG_VALUES, DIGITAL_AND_BRIGHT_CENTER or DIGITAL_AND_DARK_CENTER
+	@param startIfNot - If not already started, start now.
+	@return - started or not
+	*/
+	bool modeStarted(uint8_t deviceNumber, mode newMode, bool startIfNot = true);
+
+	/** Print printBuffer in chunks no longer than MRM_REF_CAN_PRINT_CHUNK
+	@param end - terminating 0 of the text in printBuffer
+	*/
+	void printBufferFlush(char* end);
+
+	/** Add a new reading to peak accumulators
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	@param receiverNumberInSensor - single IR transistor in mrm-ref-can
+	@param value - analog reading
+	*/
+	void peakHoldUpdate(uint8_t deviceNumber, uint8_t receiverNumberInSensor, uint16_t value);
+
 	/** If digital mode with dark center not started, start it and wait for 1. message
 	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 	@param darkCenter - Center of dark. If not, center of bright.
@@ -113,6 +203,10 @@ public:
 
 	enum RecordPeakType {NO_PEAK, MAX_PEAK, MIN_PEAK} recordPeak = NO_PEAK;
 
+	enum FilterType {FILTER_NONE, FILTER_EMA, FILTER_MEDIAN, FILTER_MEDIAN_AND_EMA};
+
+	enum Health {HEALTH_ALIVE, HEALTH_SUSPECT, HEALTH_DEAD, HEALTH_RECOVERING};
+
 	/** Constructor
 	@param robot - robot containing this board
 	@param esp32CANBusSingleton - a single instance of CAN Bus common library for all CAN Bus peripherals.
@@ -176,6 +270,48 @@ public:
 	*/
 	bool dark(uint8_t receiverNumberInSensor, uint8_t deviceNumber = 0, bool fromAnalog = false);
 
+	/** Sets filter applied to analog readings when a set of all transistors arrives
+	@param type - FILTER_EMA: exponential moving average, FILTER_MEDIAN: median of last 3 sets (spike rejection), FILTER_MEDIAN_AND_EMA: median first, then average.
+	@param emaShift - smoothing factor of the average is 1 / 2^emaShift, 1 - 7. Bigger is smoother, but slower.
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0. 0xFF - all sensors.
+	*/
+	void filterSet(FilterType type, uint8_t emaShift = 2, uint8_t deviceNumber = 0xFF);
+
+	/** Health of the device. Dead devices are restarted with exponential backoff, without blocking.
+	Each call, as well as any accessor, advances the state machine, so calling healthCheck() in the main loop keeps restarting dead devices.
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	@return - HEALTH_ALIVE, HEALTH_SUSPECT (readings late, not returned), HEALTH_DEAD (readings stopped or start failed, waiting for next attempt), HEALTH_RECOVERING (start sent, waiting for readings)
+	*/
+	Health health(uint8_t deviceNumber = 0);
+
+	/** Advance health state machine and restart dead devices whose backoff expired. Never blocks.
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0. 0xFF - all sensors.
+	*/
+	void healthCheck(uint8_t deviceNumber = 0xFF);
+
+	/** Function to be called on each health change
+	@param notification - function with arguments: device number, old health, new health. NULL - none.
+	*/
+	void healthNotificationSet(void (*notification)(uint8_t deviceNumber, uint8_t oldHealth, uint8_t newHealth)) { healthNotification = notification; }
+
+	/** Clear latency histograms
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0. 0xFF - all sensors.
+	*/
+	void latencyClear(uint8_t deviceNumber = 0xFF);
+
+	/** Start or stop recording latencies. When stopped, costs only a test of a flag.
+	@param enable - start. Otherwise stop.
+	*/
+	void latencyEnable(bool enable = true) { latencyEnabled = enable; }
+
+	/** Latency percentile
+	@param percent - 0 - 100, for example 50 for median, 99 for worst but 1%.
+	@param firstRead - from arrival of the last frame of a readings set to its first read by reading(), dark(), center(),... Otherwise age of readings on every read.
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	@return - latency is below this, in microseconds, a power of 2 (1 - below 1 us). 0xFFFFFFFF - longer than the last bucket's start. 0 - no data.
+	*/
+	uint32_t latencyPercentile(uint8_t percent, bool firstRead = true, uint8_t deviceNumber = 0);
+
 	/** Read CAN Bus message into local variables
 	@param canId - CAN Bus id
 	@param data - 8 bytes from CAN Bus message.
@@ -183,18 +319,43 @@ public:
 	*/
 	bool messageDecode(CANMessage& message);
 
+	/** Peaks recorded locally since the last call, then cleared. Unlike peakRecordingSet(), catches extremes of all the frames, even if polled slower than sensor's refresh rate.
+	Lock-free, safe to call while messageDecode() runs on another core: maximum and minimum of each transistor are taken together, so a reading arriving meanwhile ends whole either in this result or in the next one.
+	@param maximum - output, MRM_REF_CAN_SENSOR_COUNT elements, maximum analog readings. 0 if no analog reading. NULL - not needed.
+	@param minimum - output, MRM_REF_CAN_SENSOR_COUNT elements, minimum analog readings. 0xFFFF if no analog reading. NULL - not needed.
+	@param darkSeen - output, bit i set if transistor i was dark at least once: in digital readings or minimum analog below calibration's middle. NULL - not needed.
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	@return - any reading arrived or any dark seen
+	*/
+	bool peakHoldReadAndClear(uint16_t* maximum, uint16_t* minimum = NULL, uint16_t* darkSeen = NULL, uint8_t deviceNumber = 0);
+
 	/** Sets recording of peaks between refreshes
 	 * 
 	*/
 	void peakRecordingSet(RecordPeakType type, uint8_t deviceNumber = 0xFF);
 
-	/** Analog readings
+	/** Analog readings, filtered if filterSet() chose a filter
 	@param receiverNumberInSensor - single IR transistor in mrm-ref-can
 	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 	@return - analog value
 	*/
 	uint16_t reading(uint8_t receiverNumberInSensor, uint8_t deviceNumber = 0);
 
+	/** Analog readings, not filtered
+	@param receiverNumberInSensor - single IR transistor in mrm-ref-can
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	@return - analog value
+	*/
+	uint16_t readingRaw(uint8_t receiverNumberInSensor, uint8_t deviceNumber = 0);
+
+	/** All analog readings of a device in one call
+	@param values - output, MRM_REF_CAN_SENSOR_COUNT elements
+	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	@param filtered - filtered values. Otherwise raw.
+	@return - readings valid
+	*/
+	bool readings(uint16_t values[MRM_REF_CAN_SENSOR_COUNT], uint8_t deviceNumber = 0, bool filtered = true);
+
 	/** Print all readings in a line
 	*/
 	void readingsPrint();